@@ -0,0 +1,76 @@
+/*
+ load throughput: buffered stdio path vs mmap path, cold and warm cache.
+
+ usage: node bench/load.js [iterations] image [image ...]
+
+ cold cache passes drop page cache through /proc/sys/vm/drop_caches and
+ are skipped unless run as root.
+*/
+var fs = require('fs'),
+    Imlib2 = require( __dirname + '/../index' ),
+    args = process.argv.slice(2),
+    iter = parseInt( args[0], 10 ),
+    files, bytes = 0;
+
+if( isNaN( iter ) ){
+    iter = 10;
+}
+else {
+    args.shift();
+}
+files = args;
+if( !files.length ){
+    console.log( 'usage: node bench/load.js [iterations] image [image ...]' );
+    process.exit(1);
+}
+files.forEach( function( file ){
+    bytes += fs.statSync( file ).size;
+});
+
+function dropCaches()
+{
+    try {
+        fs.writeFileSync( '/proc/sys/vm/drop_caches', '3' );
+        return true;
+    }
+    catch(e){
+        return false;
+    }
+}
+
+function run( label, mapped, cold )
+{
+    var img = new Imlib2(),
+        elapsed = 0,
+        i, j, start;
+
+    try {
+        img.mmap = mapped;
+    }
+    catch(e){
+        console.log( label + ': skipped (' + e.message + ')' );
+        return;
+    }
+    for( i = 0; i < iter; i++ )
+    {
+        if( cold && !dropCaches() ){
+            console.log( label + ': skipped (cannot drop page cache)' );
+            return;
+        }
+        start = Date.now();
+        for( j = 0; j < files.length; j++ ){
+            img.load( files[j] );
+        }
+        elapsed += Date.now() - start;
+    }
+
+    console.log( label + ': ' +
+                 ( ( bytes * iter ) / 1048576 / ( elapsed / 1000 ) ).toFixed(2) +
+                 ' MB/s (' + elapsed + 'ms)' );
+}
+
+run( 'stdio cold', false, true );
+run( 'mmap  cold', true, true );
+// first iteration of warm pass fills page cache
+run( 'stdio warm', false, false );
+run( 'mmap  warm', true, false );
@@ -3,4 +3,24 @@
  author: masatoshi teruya
  email: mah0x211@gmail.com
 */
-module.exports = require( __dirname + '/build/default/Imlib2').Imlib2;
+var Imlib2 = require( __dirname + '/build/default/Imlib2').Imlib2,
+    POOL_MAX = 64,
+    pool = [];
+
+// reuse reset instances instead of allocating new ones.
+// release() throws if instance still has async load/save in flight and 
+// ignores instance that is already in pool.
+Imlib2.acquire = function(){
+    var img = pool.pop() || new Imlib2();
+    
+    img.pooled = false;
+    return img;
+};
+Imlib2.release = function( img ){
+    if( !img.pooled && pool.length < POOL_MAX ){
+        pool.push( img.reset() );
+        img.pooled = true;
+    }
+};
+
+module.exports = Imlib2;
@@ -1,17 +1,37 @@
 #include <node.h>
-#include <node_events.h>
 
 #include <errno.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <dirent.h>
 
 #include <cstring>
 #include <typeinfo>
 #include <pthread.h>
 #include "Imlib2.h"
 
+// multi-frame(animated) image api is available since imlib2 1.8.0
+#if defined(IMLIB2_VERSION) && defined(IMLIB2_VERSION_) && \
+    IMLIB2_VERSION >= IMLIB2_VERSION_(1, 8, 0)
+#define HAVE_IMLIB_FRAME    1
+#endif
+// loading from memory is available since imlib2 1.10.0
+#if defined(IMLIB2_VERSION) && defined(IMLIB2_VERSION_) && \
+    IMLIB2_VERSION >= IMLIB2_VERSION_(1, 10, 0)
+#define HAVE_IMLIB_LOAD_MEM 1
+#endif
+
 using namespace v8;
 using namespace node;
 
@@ -34,7 +54,10 @@ typedef enum {
     PERMISSION_DENIED_TO_WRITE = IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_WRITE,
     OUT_OF_DISK_SPACE = IMLIB_LOAD_ERROR_OUT_OF_DISK_SPACE,
     UNKNOWN = IMLIB_LOAD_ERROR_UNKNOWN,
-    FORMAT_UNACCEPTABLE = 1000
+    FORMAT_UNACCEPTABLE = 1000,
+    FRAME_OUT_OF_RANGE,
+    SOURCE_CHANGED,
+    INVALID_SIZE
 } ImageErrorType_e;
 
 typedef enum {
@@ -57,20 +80,185 @@ typedef struct {
 
 typedef enum ASYNC_TASK_BIT {
     ASYNC_TASK_LOAD = 1 << 0,
-    ASYNC_TASK_SAVE = 1 << 1
+    ASYNC_TASK_SAVE = 1 << 1,
+    ASYNC_TASK_DELAYS = 1 << 2
 };
-typedef struct {
+typedef struct Baton_s {
     void *ctx;
     int task;
     const char *errstr;
     void *udata;
+    // frame index for ASYNC_TASK_LOAD
+    int frame;
+    // result of ASYNC_TASK_DELAYS
+    int *delays;
+    int nframe;
     // callback js function when async is true
     Persistent<Function> callback;
-    Handle<Value> retval;
+    // result of task; converted to js value on main thread
+    ImageErrorType_e imerr;
     eio_req *req;
+    // path buffer: kept across reuse, grown only when a longer path arrives
+    char *path;
+    size_t pathcap;
+    // freelist link
+    struct Baton_s *next;
 } Baton_t;
 
-static pthread_mutex_t mutex;
+// max number of idle batons kept in freelist
+#define BATON_POOL_MAX  64
+// max pixel buffer size of spare image kept by reset()
+#define SPARE_MAX_BYTES ( 8 * 1024 * 1024 )
+
+// imlib2 keeps its context stack and caches in process global state; 
+// every imlib call must be made while holding this lock.
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// baton freelist; has own lock so it does not rely on a single JS thread
+static pthread_mutex_t baton_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Baton_t *baton_pool = NULL;
+static unsigned int baton_pool_len = 0;
+
+static Baton_t *BatonAlloc( void )
+{
+    Baton_t *baton;
+    
+    pthread_mutex_lock( &baton_mutex );
+    if( ( baton = baton_pool ) ){
+        baton_pool = baton->next;
+        baton_pool_len--;
+    }
+    pthread_mutex_unlock( &baton_mutex );
+    if( !baton ){
+        baton = new Baton_t();
+        baton->path = NULL;
+        baton->pathcap = 0;
+    }
+    baton->ctx = NULL;
+    baton->task = 0;
+    baton->errstr = NULL;
+    baton->udata = NULL;
+    baton->imerr = NOERR;
+    baton->req = NULL;
+    baton->frame = 0;
+    baton->delays = NULL;
+    baton->nframe = 0;
+    baton->next = NULL;
+    
+    return baton;
+}
+
+static void BatonRelease( Baton_t *baton )
+{
+    pthread_mutex_lock( &baton_mutex );
+    if( baton_pool_len < BATON_POOL_MAX ){
+        baton->next = baton_pool;
+        baton_pool = baton;
+        baton_pool_len++;
+        baton = NULL;
+    }
+    pthread_mutex_unlock( &baton_mutex );
+    if( baton )
+    {
+        if( baton->path ){
+            free( (void*)baton->path );
+        }
+        delete baton;
+    }
+}
+
+// copy path into baton buffer and set udata. returns NULL on failure
+static const char *BatonSetPath( Baton_t *baton, const char *path )
+{
+    size_t len = strlen( path ) + 1;
+    
+    if( len > baton->pathcap )
+    {
+        char *buf = (char*)realloc( baton->path, len );
+        
+        if( !buf ){
+            return NULL;
+        }
+        baton->path = buf;
+        baton->pathcap = len;
+    }
+    memcpy( baton->path, path, len );
+    baton->udata = (void*)baton->path;
+    
+    return baton->path;
+}
+
+
+// max pixel buffer size of per-thread scratch buffer; larger outputs use 
+// one-off image
+#define SCRATCH_MAX_BYTES   ( 16 * 1024 * 1024 )
+
+typedef struct {
+    DATA32 *buf;
+    size_t cap;
+} Scratch_t;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static unsigned long scratch_hit = 0;
+static unsigned long scratch_miss = 0;
+
+static void ScratchFree( void *arg )
+{
+    Scratch_t *scratch = (Scratch_t*)arg;
+    
+    free( (void*)scratch->buf );
+    free( (void*)scratch );
+}
+
+static void ScratchKeyInit( void )
+{
+    pthread_key_create( &scratch_key, ScratchFree );
+}
+
+// returns image of w x h whose pixels live in scratch buffer of calling 
+// thread. buffer grows to largest request up to SCRATCH_MAX_BYTES and is 
+// reused by later requests; imlib does not free wrapped data. caller must 
+// free returned image with imlib_free_image(). returns NULL on failure.
+static Imlib_Image ScratchImage( int w, int h )
+{
+    Scratch_t *scratch;
+    size_t need = (size_t)w * (size_t)h * sizeof(DATA32);
+    
+    pthread_once( &scratch_once, ScratchKeyInit );
+    if( !( scratch = (Scratch_t*)pthread_getspecific( scratch_key ) ) )
+    {
+        if( !( scratch = (Scratch_t*)calloc( 1, sizeof( Scratch_t ) ) ) ){
+            return NULL;
+        }
+        else if( pthread_setspecific( scratch_key, (void*)scratch ) ){
+            free( (void*)scratch );
+            return NULL;
+        }
+    }
+    
+    if( need <= scratch->cap ){
+        __sync_fetch_and_add( &scratch_hit, 1 );
+        return imlib_create_image_using_data( w, h, scratch->buf );
+    }
+    
+    __sync_fetch_and_add( &scratch_miss, 1 );
+    // too large to keep
+    if( need > SCRATCH_MAX_BYTES ){
+        return imlib_create_image( w, h );
+    }
+    else
+    {
+        DATA32 *buf = (DATA32*)realloc( scratch->buf, need );
+        
+        if( !buf ){
+            return NULL;
+        }
+        scratch->buf = buf;
+        scratch->cap = need;
+    }
+    
+    return imlib_create_image_using_data( w, h, scratch->buf );
+}
 
 static const char *ImlibStrError( ImageErrorType_e err )
 {
@@ -138,6 +326,18 @@ static const char *ImlibStrError( ImageErrorType_e err )
             errstr = "UNACCEPTABLE_IMAGE_FORMAT";
         break;
         
+        case FRAME_OUT_OF_RANGE:
+            errstr = "FRAME_OUT_OF_RANGE";
+        break;
+        
+        case SOURCE_CHANGED:
+            errstr = "SOURCE_CHANGED_WHILE_LOADING";
+        break;
+        
+        case INVALID_SIZE:
+            errstr = "INVALID_IMAGE_SIZE";
+        break;
+        
         case UNKNOWN:
             errstr = "UNKNOWN";
         break;
@@ -147,301 +347,1773 @@ static const char *ImlibStrError( ImageErrorType_e err )
 }
 
 
-// MARK: @interface
-class Imlib2 : public ObjectWrap
+#ifdef HAVE_IMLIB_LOAD_MEM
+// convert result of imlib_get_error(); errno or negative IMLIB_ERR_*
+static ImageErrorType_e ImlibGetError( void )
 {
-    // MARK: @public
-    public:
-        Imlib2();
-        ~Imlib2();
-        static void Initialize( Handle<Object> target );
-    // MARK: @private
-    private:
-        Imlib_Image img;
-        int attached;
-        const char *format;
-        const char *format_to;
-        const char *src;
-        unsigned int quality;
-        double scale;
-        int cropped;
-        int resized;
-        int x;
-        int y;
-        ImageSize size;
-        ImageSize crop;
-        ImageSize resize;
-        
-        // new
-        static Handle<Value> New( const Arguments& argv );
-        Handle<Value> loadImage( const char *path );
-        Handle<Value> saveImage( const char *path );
+    int err = imlib_get_error();
+    
+    switch( err )
+    {
+        case 0:
+            return UNKNOWN;
+        case ENOENT:
+            return FILE_DOES_NOT_EXIST;
+        case EISDIR:
+            return FILE_IS_DIRECTORY;
+        case EACCES:
+            return PERMISSION_DENIED_TO_READ;
+        case ENAMETOOLONG:
+            return PATH_TOO_LONG;
+        case ENOTDIR:
+            return PATH_COMPONENT_NOT_DIRECTORY;
+        case ELOOP:
+            return TOO_MANY_SYMBOLIC_LINKS;
+        case ENOMEM:
+            return OUT_OF_MEMORY;
+        case EMFILE:
+        case ENFILE:
+            return OUT_OF_FILE_DESCRIPTORS;
+        case IMLIB_ERR_NO_LOADER:
+            return NO_LOADER_FOR_FILE_FORMAT;
+        case IMLIB_ERR_BAD_FRAME:
+            return FRAME_OUT_OF_RANGE;
+    }
+    
+    return UNKNOWN;
+}
 
-        // setter/getter
-        static Handle<Value> getFormat( Local<String> prop, const AccessorInfo &info );
-        static void setFormat( Local<String> prop, Local<Value> val, const AccessorInfo &info );
-        static Handle<Value> getRawWidth( Local<String> prop, const AccessorInfo &info );
-        static Handle<Value> getRawHeight( Local<String> prop, const AccessorInfo &info );
-        static Handle<Value> getWidth( Local<String> prop, const AccessorInfo &info );
-        static Handle<Value> getHeight( Local<String> prop, const AccessorInfo &info );
-        static Handle<Value> getQuality( Local<String> prop, const AccessorInfo &info );
-        static void setQuality( Local<String> prop, Local<Value> val, const AccessorInfo &info );
-        
-        static Handle<Value> fnCrop( const Arguments &argv );
-        static Handle<Value> fnScale( const Arguments& argv );
-        static Handle<Value> fnResize( const Arguments& argv );
-        static Handle<Value> fnResizeByWidth( const Arguments& argv );
-        static Handle<Value> fnResizeByHeight( const Arguments& argv );
-        static Handle<Value> fnLoad( const Arguments& argv );
-        static Handle<Value> fnSave( const Arguments& argv );
-        
-        // thread task
-        static int beginEIO( eio_req *req );
-        static int endEIO( eio_req *req );
-};
+// SIGBUS raised while decoder reads mapped source(file truncated or 
+// replaced on remote filesystem) jumps back to LoadImageFile.
+static __thread sigjmp_buf *sigbus_jmp = NULL;
+static struct sigaction sigbus_prev;
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
 
-// MARK: @implements
-Imlib2::Imlib2()
+static void SigbusHandler( int sig, siginfo_t *info, void *uctx )
 {
-    img = NULL;
-    attached = 0;
-    format = NULL;
-    format_to = NULL;
-    src = NULL;
-    quality = 100;
-    scale = 100.0;
-    cropped = resized = 0;
-    x = y = 0;
-    size.w = crop.w = resize.w = 0;
-    size.h = crop.h = resize.h = 0;
-    size.aspect = crop.aspect = 1;
+    if( sigbus_jmp ){
+        siglongjmp( *sigbus_jmp, 1 );
+    }
+    // not ours; pass to previous handler
+    else if( sigbus_prev.sa_flags & SA_SIGINFO ){
+        sigbus_prev.sa_sigaction( sig, info, uctx );
+    }
+    else if( sigbus_prev.sa_handler != SIG_DFL && 
+             sigbus_prev.sa_handler != SIG_IGN ){
+        sigbus_prev.sa_handler( sig );
+    }
+    else {
+        signal( SIGBUS, SIG_DFL );
+        raise( SIGBUS );
+    }
 }
 
-Imlib2::~Imlib2()
+static void SigbusInit( void )
 {
-    if( src ){
-        free( (void*)src );
+    struct sigaction sa;
+    
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sa_sigaction = SigbusHandler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset( &sa.sa_mask );
+    sigaction( SIGBUS, &sa, &sigbus_prev );
+}
+#endif
+
+// load frame(0 origin) of image file by path
+static Imlib_Image LoadImagePath( const char *path, int frameIdx, ImageErrorType_e *imerr )
+{
+#ifdef HAVE_IMLIB_FRAME
+    // frame info(count, delay, canvas) is attached only by frame loader.
+    // imlib frame numbers start at 1
+    Imlib_Image loaded = imlib_load_image_frame( path, frameIdx + 1 );
+    
+    if( !loaded )
+    {
+#ifdef HAVE_IMLIB_LOAD_MEM
+        *imerr = ImlibGetError();
+#else
+        if( frameIdx > 0 ){
+            *imerr = FRAME_OUT_OF_RANGE;
+        }
+        // frame loader has no error return; ask plain loader for reason
+        else if( ( loaded = imlib_load_image_with_error_return( path, (Imlib_Load_Error*)imerr ) ) ){
+            imlib_context_set_image( loaded );
+            imlib_free_image_and_decache();
+            loaded = NULL;
+            *imerr = UNKNOWN;
+        }
+        else if( !*imerr ){
+            *imerr = UNKNOWN;
+        }
+#endif
     }
-    if( format_to ){
-        free( (void*)format_to );
+    
+    return loaded;
+#else
+    if( frameIdx > 0 ){
+        *imerr = FRAME_OUT_OF_RANGE;
+        return NULL;
     }
-    if( imlib_context_get_image() )
+    return imlib_load_image_with_error_return( path, (Imlib_Load_Error*)imerr );
+#endif
+}
+
+// load image file. if mapped is true, source is read through mmap(2); 
+// mapped input requires imlib2 >= 1.10 and is ignored otherwise.
+// a decoder interrupted by SIGBUS leaks what it had allocated so far.
+static Imlib_Image LoadImageFile( const char *path, int frameIdx, int mapped, 
+                                  ImageErrorType_e *imerr )
+{
+#ifdef HAVE_IMLIB_LOAD_MEM
+    Imlib_Image loaded = NULL;
+    struct stat st;
+    void *data = MAP_FAILED;
+    size_t len = 0;
+    int fd;
+    
+    if( mapped && ( fd = open( path, O_RDONLY ) ) != -1 )
     {
-        if( imlib_get_cache_size() ){
-            imlib_free_image_and_decache();
+        if( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 ){
+            len = (size_t)st.st_size;
+            data = mmap( NULL, len, PROT_READ, MAP_PRIVATE, fd, 0 );
+        }
+        close( fd );
+    }
+    if( data == MAP_FAILED ){
+        return LoadImagePath( path, frameIdx, imerr );
+    }
+    
+    // decoders walk the source front to back
+    madvise( data, len, MADV_SEQUENTIAL );
+    pthread_once( &sigbus_once, SigbusInit );
+    {
+        sigjmp_buf jmp;
+        
+        if( sigsetjmp( jmp, 1 ) == 0 )
+        {
+            sigbus_jmp = &jmp;
+            if( !( loaded = imlib_load_image_frame_mem( path, frameIdx + 1, data, len ) ) ){
+                *imerr = ImlibGetError();
+            }
         }
         else {
-            imlib_free_image();
+            loaded = NULL;
+            *imerr = SOURCE_CHANGED;
         }
+        sigbus_jmp = NULL;
     }
+    munmap( data, len );
+    
+    return loaded;
+#else
+    return LoadImagePath( path, frameIdx, imerr );
+#endif
 }
 
 
-int Imlib2::beginEIO( eio_req *req )
+#ifdef HAVE_IMLIB_FRAME
+// clear w x h at x/y of image to transparent black; clipped to image
+static void ClearRect( Imlib_Image image, int x, int y, int w, int h )
 {
-    Baton_t *baton = static_cast<Baton_t*>( req->data );
-    Imlib2 *ctx = (Imlib2*)baton->ctx;
+    DATA32 *data;
+    int iw, ih, x1, y1;
     
-    // failed to lock mutex
-    if( pthread_mutex_lock( &mutex ) ){
-        baton->errstr = strerror(errno);
+    imlib_context_set_image( image );
+    iw = imlib_image_get_width();
+    ih = imlib_image_get_height();
+    x1 = ( x + w < iw ) ? x + w : iw;
+    y1 = ( y + h < ih ) ? y + h : ih;
+    x = ( x > 0 ) ? x : 0;
+    y = ( y > 0 ) ? y : 0;
+    if( x < x1 && y < y1 )
+    {
+        data = imlib_image_get_data();
+        for( ; y < y1; y++ ){
+            memset( data + y * iw + x, 0, sizeof(DATA32) * ( x1 - x ) );
+        }
+        imlib_image_put_back_data( data );
     }
-    else
+}
+
+// frame loader returns raw sub-frame of frame_w x frame_h. compose frame
+// (0 origin) on canvas_w x canvas_h image: frames 0..frameIdx are drawn 
+// at their frame_x/y in order, blended if IMLIB_FRAME_BLEND is set, and 
+// disposed by DISPOSE_CLEAR/DISPOSE_PREV before next frame is drawn.
+// info receives frame info of requested frame.
+static Imlib_Image ComposeFrame( const char *path, int frameIdx, int mapped, 
+                                 ImageErrorType_e *imerr, Imlib_Frame_Info *info )
+{
+    Imlib_Image canvas = NULL;
+    Imlib_Image prev = NULL;
+    Imlib_Image loaded;
+    int i, fw, fh;
+    
+    for( i = 0; i <= frameIdx; i++ )
     {
-        if( baton->task & ASYNC_TASK_LOAD ){
-            baton->retval = ctx->loadImage( (const char*)baton->udata );
+        if( !( loaded = LoadImageFile( path, i, mapped, imerr ) ) ){
+            break;
+        }
+        imlib_context_set_image( loaded );
+        imlib_image_get_frame_info( info );
+        fw = imlib_image_get_width();
+        fh = imlib_image_get_height();
+        // frame is complete by itself
+        if( i == frameIdx && !canvas &&
+            ( info->canvas_w < 1 || info->canvas_h < 1 ||
+              ( info->frame_x == 0 && info->frame_y == 0 &&
+                fw == info->canvas_w && fh == info->canvas_h ) ) ){
+            return loaded;
+        }
+        else if( !canvas )
+        {
+            if( !( canvas = imlib_create_image( info->canvas_w > 0 ? info->canvas_w : fw, 
+                                                info->canvas_h > 0 ? info->canvas_h : fh ) ) ){
+                imlib_free_image_and_decache();
+                *imerr = OUT_OF_MEMORY;
+                break;
+            }
+            imlib_context_set_image( canvas );
+            imlib_image_set_has_alpha( 1 );
+            ClearRect( canvas, 0, 0, imlib_image_get_width(), imlib_image_get_height() );
         }
-        else if( baton->task & ASYNC_TASK_SAVE ){
-            baton->retval = ctx->saveImage( (const char*)baton->udata );
+        // canvas is restored to this state after frame
+        if( i < frameIdx && ( info->frame_flags & IMLIB_FRAME_DISPOSE_PREV ) ){
+            imlib_context_set_image( canvas );
+            prev = imlib_clone_image();
         }
         
-        // failed to unlock mutex
-        if( pthread_mutex_unlock( &mutex ) ){
-            baton->errstr = strerror(errno);
+        imlib_context_set_image( canvas );
+        imlib_context_set_blend( ( info->frame_flags & IMLIB_FRAME_BLEND ) ? 1 : 0 );
+        imlib_blend_image_onto_image( loaded, 1, 0, 0, fw, fh, 
+                                      info->frame_x, info->frame_y, fw, fh );
+        imlib_context_set_image( loaded );
+        imlib_free_image_and_decache();
+        
+        // dispose
+        if( i < frameIdx )
+        {
+            if( info->frame_flags & IMLIB_FRAME_DISPOSE_CLEAR ){
+                ClearRect( canvas, info->frame_x, info->frame_y, fw, fh );
+            }
+            else if( prev ){
+                imlib_context_set_image( canvas );
+                imlib_free_image();
+                canvas = prev;
+                prev = NULL;
+            }
+        }
+    }
+    
+    if( prev ){
+        imlib_context_set_image( prev );
+        imlib_free_image();
+    }
+    if( i <= frameIdx && canvas ){
+        imlib_context_set_image( canvas );
+        imlib_free_image();
+        canvas = NULL;
+    }
+    
+    return canvas;
+}
+#endif
+
+#ifdef HAVE_IMLIB_FRAME
+// skip data sub-blocks up to block terminator. returns 0 on success
+static int GifSkipBlocks( FILE *fp )
+{
+    int len;
+    
+    while( ( len = getc( fp ) ) > 0 )
+    {
+        if( fseek( fp, len, SEEK_CUR ) ){
+            return -1;
+        }
+    }
+    
+    return ( len == 0 ) ? 0 : -1;
+}
+
+// collect delay(ms) of frames 0..n-1 of GIF file in one pass over its 
+// blocks without decoding pixels. returns 0 if file is not a GIF.
+static int GifDelays( const char *path, int n, int *delays )
+{
+    FILE *fp = fopen( path, "rb" );
+    unsigned char buf[13];
+    int delay = 0;
+    int i = 0;
+    int c;
+    
+    if( !fp ){
+        return 0;
+    }
+    // header and logical screen descriptor
+    else if( fread( buf, 1, 13, fp ) != 13 || memcmp( buf, "GIF8", 4 ) ||
+             ( ( buf[10] & 0x80 ) && 
+               fseek( fp, 3 << ( ( buf[10] & 0x07 ) + 1 ), SEEK_CUR ) ) ){
+        fclose( fp );
+        return 0;
+    }
+    
+    while( i < n && ( c = getc( fp ) ) != EOF && c != 0x3B )
+    {
+        // extension
+        if( c == 0x21 )
+        {
+            if( ( c = getc( fp ) ) == EOF ){
+                break;
+            }
+            // graphic control extension; delay in 1/100 sec
+            else if( c == 0xF9 )
+            {
+                if( fread( buf, 1, 5, fp ) != 5 ){
+                    break;
+                }
+                delay = ( buf[2] | ( buf[3] << 8 ) ) * 10;
+                if( buf[0] > 4 && fseek( fp, buf[0] - 4, SEEK_CUR ) ){
+                    break;
+                }
+            }
+            if( GifSkipBlocks( fp ) ){
+                break;
+            }
+        }
+        // image descriptor; control extension applies to next image only
+        else if( c == 0x2C )
+        {
+            // descriptor, local color table and LZW minimum code size
+            if( fread( buf, 1, 9, fp ) != 9 ||
+                ( ( buf[8] & 0x80 ) && 
+                  fseek( fp, 3 << ( ( buf[8] & 0x07 ) + 1 ), SEEK_CUR ) ) ||
+                getc( fp ) == EOF ){
+                break;
+            }
+            delays[i++] = delay;
+            delay = 0;
+            if( GifSkipBlocks( fp ) ){
+                break;
+            }
+        }
+        // broken stream
+        else {
+            break;
         }
     }
+    fclose( fp );
+    
+    return 1;
+}
+#endif
+
+// MARK: output cache
+// encoded outputs keyed by source identity and transform state.
+// guarded by outcache.mutex, not by imlib lock; file i/o is done outside 
+// of it. evicted entries are written to spill directory by spill thread.
+#define OUTCACHE_BUCKETS    1024
+#define SRCMETA_SLOTS       256
+// default size limit of spill directory
+#define SPILL_DIR_BYTES     ( 1024 * 1024 * 1024 )
+
+#if defined(__APPLE__)
+#define ST_MTIME_NSEC(st)   ( (st)->st_mtimespec.tv_nsec )
+#define ST_CTIME_NSEC(st)   ( (st)->st_ctimespec.tv_nsec )
+#else
+#define ST_MTIME_NSEC(st)   ( (st)->st_mtim.tv_nsec )
+#define ST_CTIME_NSEC(st)   ( (st)->st_ctim.tv_nsec )
+#endif
+
+typedef struct OutCache_s {
+    char *key;
+    uint64_t hash;
+    unsigned char *data;
+    size_t len;
+    // spill file path; set when queued to spill thread
+    char *spill;
+    // bucket chain
+    struct OutCache_s *hnext;
+    // lru list(head is most recently used) or spill queue
+    struct OutCache_s *prev;
+    struct OutCache_s *next;
+} OutCache_t;
+
+// decoded source attributes; lets load() skip decoding on cache hit
+typedef struct {
+    char *key;
+    int w;
+    int h;
+    int nframe;
+    int delay;
+    char format[32];
+} SrcMeta_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    int enabled;
+    OutCache_t *bucket[OUTCACHE_BUCKETS];
+    OutCache_t *head;
+    OutCache_t *tail;
+    size_t budget;
+    size_t bytes;
+    unsigned long entries;
+    unsigned long hit;
+    unsigned long miss;
+    // spill directory
+    char *dir;
+    SrcMeta_t meta[SRCMETA_SLOTS];
+} outcache = { PTHREAD_MUTEX_INITIALIZER };
+
+// spill file written by spill thread; oldest first
+typedef struct Spilled_s {
+    char *path;
+    size_t len;
+    struct Spilled_s *next;
+} Spilled_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int running;
+    // entries waiting to be written
+    OutCache_t *qhead;
+    OutCache_t *qtail;
+    Spilled_t *fhead;
+    Spilled_t *ftail;
+    size_t budget;
+    size_t bytes;
+} spill = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int OutCacheEnabled( void )
+{
+    return __sync_fetch_and_add( &outcache.enabled, 0 );
+}
+
+// malloc'd formatted string
+static char *KeyPrintf( const char *fmt, ... )
+{
+    char *buf;
+    va_list args;
+    int len;
+    
+    va_start( args, fmt );
+    len = vsnprintf( NULL, 0, fmt, args );
+    va_end( args );
+    if( len < 0 || !( buf = (char*)malloc( len + 1 ) ) ){
+        return NULL;
+    }
+    va_start( args, fmt );
+    vsnprintf( buf, len + 1, fmt, args );
+    va_end( args );
+    
+    return buf;
+}
+
+// file is identified by device, inode, size, mtime and ctime in ns so that 
+// in-place rewrite within same second is detected.
+static char *SourceKey( const char *path, const struct stat *st, int frameIdx )
+{
+    return KeyPrintf( "%s|%llu:%llu|%lld|%lld.%09ld|%lld.%09ld|%d", path,
+                      (unsigned long long)st->st_dev, 
+                      (unsigned long long)st->st_ino,
+                      (long long)st->st_size, 
+                      (long long)st->st_mtime, (long)ST_MTIME_NSEC( st ),
+                      (long long)st->st_ctime, (long)ST_CTIME_NSEC( st ),
+                      frameIdx );
+}
+
+// returns 1 if identity fields used by SourceKey differ
+static int SourceChanged( const struct stat *a, const struct stat *b )
+{
+    return a->st_dev != b->st_dev || a->st_ino != b->st_ino ||
+           a->st_size != b->st_size ||
+           a->st_mtime != b->st_mtime || ST_MTIME_NSEC( a ) != ST_MTIME_NSEC( b ) ||
+           a->st_ctime != b->st_ctime || ST_CTIME_NSEC( a ) != ST_CTIME_NSEC( b );
+}
+
+// FNV-1a
+static uint64_t OutCacheHash( const char *key )
+{
+    uint64_t hash = 14695981039346656037ULL;
+    
+    for(; *key; key++ ){
+        hash ^= (unsigned char)*key;
+        hash *= 1099511628211ULL;
+    }
+    
+    return hash;
+}
+
+// must be called while holding outcache.mutex
+static char *OutCacheSpillPath( uint64_t hash )
+{
+    return KeyPrintf( "%s/%016llx", outcache.dir, (unsigned long long)hash );
+}
+
+static ImageErrorType_e OutCacheErrno( int err )
+{
+    switch( err )
+    {
+        case EACCES:
+        case EROFS:
+            return PERMISSION_DENIED_TO_WRITE;
+        case ENOSPC:
+            return OUT_OF_DISK_SPACE;
+        case ENOENT:
+            return PATH_COMPONENT_NON_EXISTANT;
+        case ENOTDIR:
+            return PATH_COMPONENT_NOT_DIRECTORY;
+        case ENAMETOOLONG:
+            return PATH_TOO_LONG;
+        case EMFILE:
+        case ENFILE:
+            return OUT_OF_FILE_DESCRIPTORS;
+        case ENOMEM:
+            return OUT_OF_MEMORY;
+    }
+    
+    return UNKNOWN;
+}
+
+static ImageErrorType_e OutCacheWriteFile( const char *path, const char *key, 
+                                           const unsigned char *data, size_t len )
+{
+    ImageErrorType_e imerr = NOERR;
+    FILE *fp = fopen( path, "wb" );
+    
+    if( !fp ){
+        return OutCacheErrno( errno );
+    }
+    // spill file starts with key to detect hash collision
+    if( ( key && fwrite( key, strlen( key ) + 1, 1, fp ) != 1 ) ||
+        ( len && fwrite( data, len, 1, fp ) != 1 ) ){
+        imerr = OutCacheErrno( errno );
+    }
+    if( fclose( fp ) && !imerr ){
+        imerr = OutCacheErrno( errno );
+    }
+    
+    return imerr;
+}
+
+// read whole file into malloc'd buffer. skip leading key if key is not NULL 
+// and returns NULL if it does not match.
+static unsigned char *OutCacheReadFile( const char *path, const char *key, size_t *len )
+{
+    unsigned char *data = NULL;
+    struct stat st;
+    size_t klen = ( key ) ? strlen( key ) + 1 : 0;
+    FILE *fp = fopen( path, "rb" );
+    
+    if( !fp ){
+        return NULL;
+    }
+    if( fstat( fileno( fp ), &st ) == 0 && (size_t)st.st_size > klen &&
+        ( data = (unsigned char*)malloc( st.st_size ) ) )
+    {
+        if( fread( data, st.st_size, 1, fp ) != 1 || 
+            ( klen && memcmp( data, key, klen ) ) ){
+            free( (void*)data );
+            data = NULL;
+        }
+        else {
+            *len = st.st_size - klen;
+            memmove( data, data + klen, *len );
+        }
+    }
+    fclose( fp );
+    
+    return data;
+}
+
+static void OutCacheFree( OutCache_t *entry )
+{
+    free( (void*)entry->key );
+    free( (void*)entry->data );
+    free( (void*)entry->spill );
+    free( (void*)entry );
+}
+
+// write spill file under temporary name and move it into place so that 
+// a partial write is never served
+static int SpillWrite( OutCache_t *entry )
+{
+    char *tmp = KeyPrintf( "%s.tmp", entry->spill );
+    int rc = 0;
+    
+    if( tmp )
+    {
+        if( OutCacheWriteFile( tmp, entry->key, entry->data, entry->len ) == NOERR &&
+            rename( tmp, entry->spill ) == 0 ){
+            rc = 1;
+        }
+        else {
+            unlink( tmp );
+        }
+        free( (void*)tmp );
+    }
+    
+    return rc;
+}
+
+// must be called while holding spill.mutex
+static void SpillForget( int remove )
+{
+    Spilled_t *file;
+    
+    while( ( file = spill.fhead ) )
+    {
+        spill.fhead = file->next;
+        if( remove ){
+            unlink( file->path );
+        }
+        free( (void*)file->path );
+        free( (void*)file );
+    }
+    spill.ftail = NULL;
+    spill.bytes = 0;
+}
+
+// remove record of spill file at path and unlink it if remove is true.
+// must be called while holding spill.mutex
+static void SpillDrop( const char *path, int remove )
+{
+    Spilled_t *file = spill.fhead;
+    Spilled_t *prev = NULL;
+    
+    for( ; file; prev = file, file = file->next )
+    {
+        if( strcmp( file->path, path ) == 0 )
+        {
+            if( prev ){
+                prev->next = file->next;
+            }
+            else {
+                spill.fhead = file->next;
+            }
+            if( spill.ftail == file ){
+                spill.ftail = prev;
+            }
+            spill.bytes -= file->len;
+            free( (void*)file->path );
+            free( (void*)file );
+            break;
+        }
+    }
+    if( remove ){
+        unlink( path );
+    }
+}
+
+static void *SpillMain( void * )
+{
+    OutCache_t *entry;
+    Spilled_t *file;
+    
+    pthread_mutex_lock( &spill.mutex );
+    while( 1 )
+    {
+        while( !spill.qhead ){
+            pthread_cond_wait( &spill.cond, &spill.mutex );
+        }
+        entry = spill.qhead;
+        if( !( spill.qhead = entry->next ) ){
+            spill.qtail = NULL;
+        }
+        pthread_mutex_unlock( &spill.mutex );
+        
+        if( SpillWrite( entry ) && 
+            ( file = (Spilled_t*)malloc( sizeof( Spilled_t ) ) ) )
+        {
+            file->path = entry->spill;
+            file->len = entry->len;
+            file->next = NULL;
+            entry->spill = NULL;
+            
+            pthread_mutex_lock( &spill.mutex );
+            // file was rewritten; forget record of previous write
+            SpillDrop( file->path, 0 );
+            if( spill.ftail ){
+                spill.ftail->next = file;
+            }
+            else {
+                spill.fhead = file;
+            }
+            spill.ftail = file;
+            spill.bytes += file->len;
+            // remove oldest files over budget
+            while( spill.bytes > spill.budget && ( file = spill.fhead ) )
+            {
+                if( !( spill.fhead = file->next ) ){
+                    spill.ftail = NULL;
+                }
+                spill.bytes -= file->len;
+                unlink( file->path );
+                free( (void*)file->path );
+                free( (void*)file );
+            }
+            pthread_mutex_unlock( &spill.mutex );
+        }
+        OutCacheFree( entry );
+        pthread_mutex_lock( &spill.mutex );
+    }
+    
+    return NULL;
+}
+
+// queue entry to spill thread; takes ownership. 
+// must be called while holding outcache.mutex
+static void OutCacheSpill( OutCache_t *entry )
+{
+    if( !outcache.dir || !spill.running || 
+        !( entry->spill = OutCacheSpillPath( entry->hash ) ) ){
+        OutCacheFree( entry );
+        return;
+    }
+    entry->next = NULL;
+    pthread_mutex_lock( &spill.mutex );
+    if( spill.qtail ){
+        spill.qtail->next = entry;
+    }
+    else {
+        spill.qhead = entry;
+    }
+    spill.qtail = entry;
+    pthread_cond_signal( &spill.cond );
+    pthread_mutex_unlock( &spill.mutex );
+}
+
+// remove spill files left by previous run
+static void SpillCleanup( const char *dir )
+{
+    DIR *dp = opendir( dir );
+    struct dirent *ent;
+    char *path;
+    size_t len;
+    
+    if( !dp ){
+        return;
+    }
+    while( ( ent = readdir( dp ) ) )
+    {
+        len = strlen( ent->d_name );
+        if( ( len == 16 || ( len == 20 && !strcmp( ent->d_name + 16, ".tmp" ) ) ) &&
+            strspn( ent->d_name, "0123456789abcdef" ) == 16 &&
+            ( path = KeyPrintf( "%s/%s", dir, ent->d_name ) ) ){
+            unlink( path );
+            free( (void*)path );
+        }
+    }
+    closedir( dp );
+}
+
+static void OutCacheUnlink( OutCache_t *entry )
+{
+    OutCache_t **ptr = &outcache.bucket[entry->hash % OUTCACHE_BUCKETS];
+    
+    for(; *ptr; ptr = &(*ptr)->hnext )
+    {
+        if( *ptr == entry ){
+            *ptr = entry->hnext;
+            break;
+        }
+    }
+    if( entry->prev ){
+        entry->prev->next = entry->next;
+    }
+    else {
+        outcache.head = entry->next;
+    }
+    if( entry->next ){
+        entry->next->prev = entry->prev;
+    }
+    else {
+        outcache.tail = entry->prev;
+    }
+    __sync_fetch_and_sub( &outcache.bytes, entry->len );
+    __sync_fetch_and_sub( &outcache.entries, 1 );
+}
+
+// must be called while holding outcache.mutex
+static void OutCacheClear( void )
+{
+    OutCache_t *entry;
+    int i;
+    
+    while( ( entry = outcache.tail ) ){
+        OutCacheUnlink( entry );
+        OutCacheFree( entry );
+    }
+    for( i = 0; i < SRCMETA_SLOTS; i++ )
+    {
+        if( outcache.meta[i].key ){
+            free( (void*)outcache.meta[i].key );
+            outcache.meta[i].key = NULL;
+        }
+    }
+}
+
+static OutCache_t *OutCacheFind( const char *key, uint64_t hash )
+{
+    OutCache_t *entry = outcache.bucket[hash % OUTCACHE_BUCKETS];
+    
+    for(; entry; entry = entry->hnext )
+    {
+        if( entry->hash == hash && !strcmp( entry->key, key ) ){
+            return entry;
+        }
+    }
+    
+    return NULL;
+}
+
+// takes ownership of data. entries over budget are spilled if dir is set.
+// must be called while holding outcache.mutex
+static void OutCacheInsert( const char *key, uint64_t hash, unsigned char *data, size_t len )
+{
+    OutCache_t *entry;
+    
+    if( OutCacheFind( key, hash ) ||
+        !( entry = (OutCache_t*)calloc( 1, sizeof( OutCache_t ) ) ) ){
+        free( (void*)data );
+        return;
+    }
+    else if( !( entry->key = strdup( key ) ) ){
+        free( (void*)entry );
+        free( (void*)data );
+        return;
+    }
+    entry->hash = hash;
+    entry->data = data;
+    entry->len = len;
+    
+    if( len > outcache.budget ){
+        OutCacheSpill( entry );
+        return;
+    }
+    // evict least recently used
+    while( outcache.bytes + len > outcache.budget )
+    {
+        OutCache_t *lru = outcache.tail;
+        
+        OutCacheUnlink( lru );
+        OutCacheSpill( lru );
+    }
+    entry->hnext = outcache.bucket[hash % OUTCACHE_BUCKETS];
+    outcache.bucket[hash % OUTCACHE_BUCKETS] = entry;
+    entry->prev = NULL;
+    entry->next = outcache.head;
+    if( outcache.head ){
+        outcache.head->prev = entry;
+    }
+    else {
+        outcache.tail = entry;
+    }
+    outcache.head = entry;
+    __sync_fetch_and_add( &outcache.bytes, len );
+    __sync_fetch_and_add( &outcache.entries, 1 );
+}
+
+// write cached output of key to path. returns 1 on hit
+static int OutCacheFetch( const char *key, const char *path, ImageErrorType_e *imerr )
+{
+    uint64_t hash = OutCacheHash( key );
+    OutCache_t *entry;
+    unsigned char *data = NULL;
+    char *spillpath = NULL;
+    size_t len = 0;
+    
+    pthread_mutex_lock( &outcache.mutex );
+    if( ( entry = OutCacheFind( key, hash ) ) )
+    {
+        // move to head of lru list
+        if( entry->prev )
+        {
+            entry->prev->next = entry->next;
+            if( entry->next ){
+                entry->next->prev = entry->prev;
+            }
+            else {
+                outcache.tail = entry->prev;
+            }
+            entry->prev = NULL;
+            entry->next = outcache.head;
+            outcache.head->prev = entry;
+            outcache.head = entry;
+        }
+        // copy to write without lock
+        if( ( data = (unsigned char*)malloc( entry->len ? entry->len : 1 ) ) ){
+            memcpy( data, entry->data, entry->len );
+            len = entry->len;
+        }
+    }
+    else if( outcache.dir ){
+        spillpath = OutCacheSpillPath( hash );
+    }
+    pthread_mutex_unlock( &outcache.mutex );
+    
+    if( spillpath ){
+        data = OutCacheReadFile( spillpath, key, &len );
+    }
+    if( !data ){
+        __sync_fetch_and_add( &outcache.miss, 1 );
+        free( (void*)spillpath );
+        return 0;
+    }
+    
+    __sync_fetch_and_add( &outcache.hit, 1 );
+    *imerr = OutCacheWriteFile( path, NULL, data, len );
+    // promote spilled entry back to memory; its file is written again 
+    // when evicted
+    if( spillpath )
+    {
+        pthread_mutex_lock( &outcache.mutex );
+        if( outcache.budget && len <= outcache.budget ){
+            OutCacheInsert( key, hash, data, len );
+            data = NULL;
+        }
+        pthread_mutex_unlock( &outcache.mutex );
+        if( !data ){
+            pthread_mutex_lock( &spill.mutex );
+            SpillDrop( spillpath, 1 );
+            pthread_mutex_unlock( &spill.mutex );
+        }
+        free( (void*)spillpath );
+    }
+    free( (void*)data );
+    
+    return 1;
+}
+
+// keep encoded output that was just written to path
+static void OutCacheStore( const char *key, const char *path )
+{
+    unsigned char *data;
+    size_t len;
+    
+    if( ( data = OutCacheReadFile( path, NULL, &len ) ) ){
+        pthread_mutex_lock( &outcache.mutex );
+        OutCacheInsert( key, OutCacheHash( key ), data, len );
+        pthread_mutex_unlock( &outcache.mutex );
+    }
+}
+
+// copy attributes of source to meta. returns 1 if found
+static int SrcMetaFind( const char *key, SrcMeta_t *meta )
+{
+    SrcMeta_t *slot = &outcache.meta[OutCacheHash( key ) % SRCMETA_SLOTS];
+    int found = 0;
+    
+    pthread_mutex_lock( &outcache.mutex );
+    if( slot->key && !strcmp( slot->key, key ) ){
+        *meta = *slot;
+        meta->key = NULL;
+        found = 1;
+    }
+    pthread_mutex_unlock( &outcache.mutex );
+    
+    return found;
+}
+
+static void SrcMetaStore( const char *key, int w, int h, int nframe, int delay, 
+                          const char *format )
+{
+    SrcMeta_t *slot = &outcache.meta[OutCacheHash( key ) % SRCMETA_SLOTS];
+    
+    pthread_mutex_lock( &outcache.mutex );
+    if( slot->key ){
+        free( (void*)slot->key );
+    }
+    if( ( slot->key = strdup( key ) ) ){
+        slot->w = w;
+        slot->h = h;
+        slot->nframe = nframe;
+        slot->delay = delay;
+        snprintf( slot->format, sizeof( slot->format ), "%s", format ? format : "" );
+    }
+    pthread_mutex_unlock( &outcache.mutex );
+}
+
+
+// MARK: @interface
+class Imlib2 : public ObjectWrap
+{
+    // MARK: @public
+    public:
+        Imlib2();
+        ~Imlib2();
+        static void Initialize( Handle<Object> target );
+    // MARK: @private
+    private:
+        // own imlib context; pushed while this instance works on images
+        Imlib_Context imctx;
+        Imlib_Image img;
+        int attached;
+        const char *format;
+        const char *format_to;
+        const char *src;
+        unsigned int quality;
+        // read source through mmap(2)
+        int mapped;
+        double scale;
+        int cropped;
+        int resized;
+        // animated image: number of frames, current frame index and its 
+        // display delay in milliseconds
+        int nframe;
+        int frame;
+        int delay;
+        int x;
+        int y;
+        ImageSize size;
+        ImageSize crop;
+        ImageSize resize;
+        // detached image kept by reset() to reuse its pixel buffer
+        Imlib_Image spare;
+        // number of async tasks in flight
+        unsigned int pending;
+        // source identity for output cache
+        struct stat srcstat;
+        int srcstat_ok;
+        // attributes came from output cache; decode is deferred until save
+        int deferred;
+        char fmtbuf[32];
+        
+        // new
+        static Handle<Value> New( const Arguments& argv );
+        void initState( void );
+        int enter( void );
+        int leave( void );
+        void releaseImage( void );
+        ImageErrorType_e decodeImage( const char *path, int frameIdx );
+        char *outputKey( void );
+        ImageErrorType_e loadImage( const char *path, int frameIdx = 0 );
+        ImageErrorType_e saveImage( const char *path );
+        int saveFile( const char *path, ImageErrorType_e *imerr );
+        int collectDelays( const char *path, int n, int *delays );
+
+        // setter/getter
+        static Handle<Value> getFormat( Local<String> prop, const AccessorInfo &info );
+        static void setFormat( Local<String> prop, Local<Value> val, const AccessorInfo &info );
+        static Handle<Value> getRawWidth( Local<String> prop, const AccessorInfo &info );
+        static Handle<Value> getRawHeight( Local<String> prop, const AccessorInfo &info );
+        static Handle<Value> getWidth( Local<String> prop, const AccessorInfo &info );
+        static Handle<Value> getHeight( Local<String> prop, const AccessorInfo &info );
+        static Handle<Value> getQuality( Local<String> prop, const AccessorInfo &info );
+        static Handle<Value> getFrameCount( Local<String> prop, const AccessorInfo &info );
+        static Handle<Value> getFrameIndex( Local<String> prop, const AccessorInfo &info );
+        static Handle<Value> getDelay( Local<String> prop, const AccessorInfo &info );
+        static void setQuality( Local<String> prop, Local<Value> val, const AccessorInfo &info );
+        static Handle<Value> getMmap( Local<String> prop, const AccessorInfo &info );
+        static void setMmap( Local<String> prop, Local<Value> val, const AccessorInfo &info );
+        
+        static Handle<Value> fnCrop( const Arguments &argv );
+        static Handle<Value> fnScale( const Arguments& argv );
+        static Handle<Value> fnResize( const Arguments& argv );
+        static Handle<Value> fnResizeByWidth( const Arguments& argv );
+        static Handle<Value> fnResizeByHeight( const Arguments& argv );
+        static Handle<Value> fnLoad( const Arguments& argv );
+        static Handle<Value> fnSave( const Arguments& argv );
+        static Handle<Value> fnReset( const Arguments& argv );
+        static Handle<Value> fnFrame( const Arguments& argv );
+        static Handle<Value> fnDelays( const Arguments& argv );
+        static Handle<Value> fnScratchStats( const Arguments& argv );
+        static Handle<Value> fnCache( const Arguments& argv );
+        static Handle<Value> fnCacheStats( const Arguments& argv );
+        
+        // thread task
+        static int beginEIO( eio_req *req );
+        static int endEIO( eio_req *req );
+};
+
+// MARK: @implements
+Imlib2::Imlib2()
+{
+    imctx = imlib_context_new();
+    img = NULL;
+    spare = NULL;
+    pending = 0;
+    src = NULL;
+    format_to = NULL;
+    initState();
+}
+
+Imlib2::~Imlib2()
+{
+    // context is freed under lock too; leaked if lock fails
+    if( !enter() )
+    {
+        releaseImage();
+        if( spare ){
+            imlib_context_set_image( spare );
+            imlib_free_image();
+        }
+        imlib_context_pop();
+        imlib_context_free( imctx );
+        pthread_mutex_unlock( &mutex );
+    }
+    if( src ){
+        free( (void*)src );
+    }
+    if( format_to ){
+        free( (void*)format_to );
+    }
+}
+
+void Imlib2::initState( void )
+{
+    attached = 0;
+    format = NULL;
+    srcstat_ok = 0;
+    deferred = 0;
+    if( src ){
+        free( (void*)src );
+        src = NULL;
+    }
+    if( format_to ){
+        free( (void*)format_to );
+        format_to = NULL;
+    }
+    quality = 100;
+    mapped = 0;
+    scale = 100.0;
+    cropped = resized = 0;
+    nframe = 1;
+    frame = delay = 0;
+    x = y = 0;
+    size.w = crop.w = resize.w = 0;
+    size.h = crop.h = resize.h = 0;
+    size.aspect = crop.aspect = 1;
+}
+
+// lock imlib and make own context current. returns 0 or error number
+int Imlib2::enter( void )
+{
+    int rc = pthread_mutex_lock( &mutex );
+    
+    if( !rc ){
+        imlib_context_push( imctx );
+    }
+    
+    return rc;
+}
+
+int Imlib2::leave( void )
+{
+    imlib_context_pop();
+    return pthread_mutex_unlock( &mutex );
+}
+
+void Imlib2::releaseImage( void )
+{
+    if( img )
+    {
+        imlib_context_set_image( img );
+        if( imlib_get_cache_size() ){
+            imlib_free_image_and_decache();
+        }
+        else {
+            imlib_free_image();
+        }
+        img = NULL;
+    }
+}
+
+
+int Imlib2::beginEIO( eio_req *req )
+{
+    Baton_t *baton = static_cast<Baton_t*>( req->data );
+    Imlib2 *ctx = (Imlib2*)baton->ctx;
+    int rc;
+    
+    // takes lock for each frame
+    if( baton->task & ASYNC_TASK_DELAYS )
+    {
+        if( ( rc = ctx->collectDelays( (const char*)baton->udata, 
+                                       baton->nframe, baton->delays ) ) ){
+            baton->errstr = strerror(rc);
+        }
+    }
+    // takes lock only to render
+    else if( baton->task & ASYNC_TASK_SAVE )
+    {
+        if( ( rc = ctx->saveFile( (const char*)baton->udata, &baton->imerr ) ) ){
+            baton->errstr = strerror(rc);
+        }
+    }
+    // failed to lock mutex
+    else if( ( rc = ctx->enter() ) ){
+        baton->errstr = strerror(rc);
+    }
+    else
+    {
+        baton->imerr = ctx->loadImage( (const char*)baton->udata, baton->frame );
+        
+        // failed to unlock mutex
+        if( ( rc = ctx->leave() ) ){
+            baton->errstr = strerror(rc);
+        }
+    }
+    
+    return 0;
+}
+
+int Imlib2::endEIO( eio_req *req )
+{
+    HandleScope scope;
+    Baton_t *baton = static_cast<Baton_t*>(req->data);
+    Imlib2 *ctx = (Imlib2*)baton->ctx;
+    int task = baton->task;
+    Local<Function> cb = Local<Function>::New( baton->callback );
+    Handle<Primitive> t = Undefined();
+    Local<Value> errstr = reinterpret_cast<Local<Value>&>(t);
+    Local<Value> argv[] = {
+        reinterpret_cast<Local<Value>&>(errstr),
+        reinterpret_cast<Local<Value>&>(t)
+    };
+    int argc = 1;
+
+    ev_unref(EV_DEFAULT_UC);
+    ctx->pending--;
+    ctx->Unref();
+    
+    if( baton->errstr ){
+        errstr = Exception::Error( String::New( baton->errstr ) );
+    }
+    else if( baton->imerr ){
+        errstr = Exception::Error( String::New( ImlibStrError( baton->imerr ) ) );
+    }
+    else if( task & ASYNC_TASK_DELAYS )
+    {
+        Local<Array> delays = Array::New( baton->nframe );
+        int i;
+        
+        for( i = 0; i < baton->nframe; i++ ){
+            delays->Set( i, Number::New( baton->delays[i] ) );
+        }
+        argv[1] = delays;
+        argc = 2;
+    }
+    argv[0] = errstr;
+    
+    // cleanup
+    if( baton->delays ){
+        free( (void*)baton->delays );
+        baton->delays = NULL;
+    }
+    baton->callback.Dispose();
+    baton->callback.Clear();
+    BatonRelease( baton );
+    
+    TryCatch try_catch;
+    // call js function by callback function context
+    // !!!: which is better callback or Context::GetCurrent()->Global() context
+    cb->Call( ctx->handle_, argc, argv );
+    if( try_catch.HasCaught() ){
+        FatalException(try_catch);
+    }
+    
+    eio_cancel(req);
+    
+    return 0;
+}
+
+Handle<Value> Imlib2::New( const Arguments& argv )
+{
+    HandleScope scope;
+    Imlib2 *ctx = new Imlib2();
+    
+    ctx->Wrap( argv.This() );
+    
+    return scope.Close( argv.This() );
+}
+
+
+ImageErrorType_e Imlib2::decodeImage( const char *path, int frameIdx )
+{
+    ImageErrorType_e imerr = NOERR;
+    Imlib_Image loaded = NULL;
+    
+#ifdef HAVE_IMLIB_FRAME
+    Imlib_Frame_Info info;
+#endif
+    
+    releaseImage();
+    
+#ifdef HAVE_IMLIB_FRAME
+    loaded = ComposeFrame( path, frameIdx, mapped, &imerr, &info );
+#else
+    loaded = LoadImageFile( path, frameIdx, mapped, &imerr );
+#endif
+    
+    if( !imerr )
+    {
+        int w, h;
+        
+        imlib_context_set_image( loaded );
+        frame = frameIdx;
+        nframe = 1;
+        delay = 0;
+#ifdef HAVE_IMLIB_FRAME
+        if( info.frame_count > 1 ){
+            nframe = info.frame_count;
+        }
+        delay = info.frame_delay;
+#endif
+        w = imlib_image_get_width();
+        h = imlib_image_get_height();
+        
+        // reuse pixel buffer of spare image if it has the same size
+        if( spare )
+        {
+            imlib_context_set_image( spare );
+            if( imlib_image_get_width() == w && imlib_image_get_height() == h )
+            {
+                DATA32 *dest = imlib_image_get_data();
+                
+                imlib_context_set_image( loaded );
+                memcpy( dest, imlib_image_get_data_for_reading_only(), 
+                        sizeof(DATA32) * w * h );
+                char alpha = imlib_image_has_alpha();
+                imlib_context_set_image( spare );
+                imlib_image_put_back_data( dest );
+                imlib_image_set_has_alpha( alpha );
+                img = spare;
+            }
+            else {
+                imlib_free_image();
+            }
+            spare = NULL;
+        }
+        
+        imlib_context_set_image( loaded );
+        if( !img ){
+            img = imlib_clone_image();
+        }
+        else {
+            const char *fmt = imlib_image_format();
+            imlib_context_set_image( img );
+            imlib_image_set_format( fmt );
+            imlib_context_set_image( loaded );
+        }
+        imlib_free_image_and_decache();
+        // loaded image owned format string; refer to the one of img
+        imlib_context_set_image( img );
+        format = imlib_image_format();
+    }
+    
+    return imerr;
+}
+
+ImageErrorType_e Imlib2::loadImage( const char *path, int frameIdx )
+{
+    ImageErrorType_e imerr = NOERR;
+    struct stat st;
+    char *key = NULL;
+    SrcMeta_t meta;
+    
+    releaseImage();
+    deferred = 0;
+    if( OutCacheEnabled() && stat( path, &st ) == 0 ){
+        key = SourceKey( path, &st, frameIdx );
+    }
+    
+    // same source was decoded before; skip decoding until needed
+    if( key && SrcMetaFind( key, &meta ) )
+    {
+        frame = frameIdx;
+        nframe = meta.nframe;
+        delay = meta.delay;
+        size.w = meta.w;
+        size.h = meta.h;
+        memcpy( fmtbuf, meta.format, sizeof( fmtbuf ) );
+        format = fmtbuf;
+        deferred = 1;
+    }
+    else if( !( imerr = decodeImage( path, frameIdx ) ) )
+    {
+        imlib_context_set_image( img );
+        size.w = imlib_image_get_width();
+        size.h = imlib_image_get_height();
+        if( key ){
+            SrcMetaStore( key, size.w, size.h, nframe, delay, format );
+        }
+    }
+    
+    if( imerr )
+    {
+        // forget previous source; frame() must not reopen it
+        if( src ){
+            free( (void*)src );
+            src = NULL;
+        }
+        attached = 0;
+        srcstat_ok = 0;
+    }
+    else
+    {
+        attached = 1;
+        if( src != path )
+        {
+            if( src ){
+                free( (void*)src );
+            }
+            src = strdup(path);
+        }
+        if( ( srcstat_ok = ( key != NULL ) ) ){
+            srcstat = st;
+        }
+        crop.w = resize.w = size.w;
+        crop.h = resize.h = size.h;
+        size.aspect = crop.aspect = (double)size.w/(double)size.h;
+    }
+    free( (void*)key );
+    
+    return imerr;
+}
+
+// malloc'd key of source identity and transform state
+char *Imlib2::outputKey( void )
+{
+    char *skey = SourceKey( src, &srcstat, frame );
+    char *key = NULL;
+    
+    if( skey ){
+        key = KeyPrintf( "%s|%d:%d,%d,%d,%d|%d:%d,%d|%s|%u", skey,
+                         cropped, x, y, crop.w, crop.h, 
+                         resized, resize.w, resize.h,
+                         format_to ? format_to : ( format ? format : "" ), 
+                         quality );
+        free( (void*)skey );
+    }
     
-    return 0;
+    return key;
 }
 
-int Imlib2::endEIO( eio_req *req )
+
+Handle<Value> Imlib2::fnLoad( const Arguments& argv )
 {
     HandleScope scope;
-    Baton_t *baton = static_cast<Baton_t*>(req->data);
-    Imlib2 *ctx = (Imlib2*)baton->ctx;
-    int task = baton->task;
-    Local<Function> cb = Local<Function>::New( baton->callback );
-    Handle<Primitive> t = Undefined();
-    Local<Value> errstr = reinterpret_cast<Local<Value>&>(t);
-    Local<Value> argv[] = {
-        reinterpret_cast<Local<Value>&>(errstr)
-    };
+    Imlib2 *ctx = ObjectUnwrap( Imlib2, argv.This() );
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    bool callback = false;
 
-    ev_unref(EV_DEFAULT_UC);
-    ctx->Unref();
-    
-    if( baton->errstr ){
-        errstr = Exception::Error( String::New( baton->errstr ) );
+    if( argc < 1 || 
+        !argv[0]->IsString() || !argv[0]->ToString()->Length() ||
+        ( argc > 1 && !( callback = argv[1]->IsFunction() ) ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "load( path_to_image:String, [callback:Function] )" ) ) );
     }
-    else if( IsDefined( baton->retval ) ){
-        errstr = Exception::Error( baton->retval->ToString() );
+    // async task still refers to img/src
+    else if( ctx->pending ){
+        retval = ThrowException( Exception::Error( String::New( "load() while async task is pending" ) ) );
     }
-    
-    // cleanup
-    baton->callback.Dispose();
-    if( baton->udata ){
-        free((void*)baton->udata);
+    else if( callback )
+    {
+        Baton_t *baton = BatonAlloc();
+        
+        baton->task = ASYNC_TASK_LOAD;
+        baton->ctx = (void*)ctx;
+        if( !BatonSetPath( baton, *String::Utf8Value( argv[0] ) ) ){
+            BatonRelease( baton );
+            return scope.Close( ThrowException( Exception::Error( String::New( strerror(errno) ) ) ) );
+        }
+        // detouch from GC
+        baton->callback = Persistent<Function>::New( Local<Function>::Cast( argv[1] ) );
+        ctx->Wrap( argv.This() );
+        ctx->Ref();
+        ctx->pending++;
+        baton->req = eio_custom( beginEIO, EIO_PRI_DEFAULT, endEIO, baton );
+        ev_ref(EV_DEFAULT_UC);
     }
-    delete baton;
-    
-    TryCatch try_catch;
-    // call js function by callback function context
-    // !!!: which is better callback or Context::GetCurrent()->Global() context
-    cb->Call( ctx->handle_, 1, argv );
-    if( try_catch.HasCaught() ){
-        FatalException(try_catch);
+    else
+    {
+        ImageErrorType_e imerr;
+        int rc;
+        
+        if( ( rc = ctx->enter() ) ){
+            retval = ThrowException( Exception::Error( String::New( strerror(rc) ) ) );
+        }
+        else
+        {
+            imerr = ctx->loadImage( *String::Utf8Value( argv[0] ) );
+            ctx->leave();
+            // failed
+            if( imerr ){
+                retval = ThrowException( Exception::Error( String::New( ImlibStrError( imerr ) ) ) );
+            }
+        }
     }
     
-    eio_cancel(req);
-    
-    return 0;
+    return scope.Close( retval );
 }
 
-Handle<Value> Imlib2::New( const Arguments& argv )
+Handle<Value> Imlib2::fnFrame( const Arguments& argv )
 {
     HandleScope scope;
-    Imlib2 *ctx = new Imlib2();
+    Imlib2 *ctx = ObjectUnwrap( Imlib2, argv.This() );
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    bool callback = false;
+    int idx;
     
-    ctx->Wrap( argv.This() );
+    if( argc < 1 || !argv[0]->IsNumber() || ( idx = argv[0]->Int32Value() ) < 0 ||
+        ( argc > 1 && !( callback = argv[1]->IsFunction() ) ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "frame( index:Number >= 0, [callback:Function] )" ) ) );
+    }
+    // src and nframe are replaced by async task
+    else if( ctx->pending ){
+        retval = ThrowException( Exception::Error( String::New( "frame() while async task is pending" ) ) );
+    }
+    else if( !ctx->src ){
+        retval = ThrowException( Exception::Error( String::New( "image not loaded" ) ) );
+    }
+    else if( idx >= ctx->nframe ){
+        retval = ThrowException( Exception::RangeError( String::New( ImlibStrError( FRAME_OUT_OF_RANGE ) ) ) );
+    }
+    else if( callback )
+    {
+        Baton_t *baton = BatonAlloc();
+        
+        baton->task = ASYNC_TASK_LOAD;
+        baton->ctx = (void*)ctx;
+        baton->frame = idx;
+        if( !BatonSetPath( baton, ctx->src ) ){
+            BatonRelease( baton );
+            return scope.Close( ThrowException( Exception::Error( String::New( strerror(errno) ) ) ) );
+        }
+        // detouch from GC
+        baton->callback = Persistent<Function>::New( Local<Function>::Cast( argv[1] ) );
+        ctx->Ref();
+        ctx->pending++;
+        baton->req = eio_custom( beginEIO, EIO_PRI_DEFAULT, endEIO, baton );
+        ev_ref(EV_DEFAULT_UC);
+    }
+    else
+    {
+        ImageErrorType_e imerr;
+        int rc;
+        
+        if( ( rc = ctx->enter() ) ){
+            retval = ThrowException( Exception::Error( String::New( strerror(rc) ) ) );
+        }
+        else
+        {
+            imerr = ctx->loadImage( ctx->src, idx );
+            ctx->leave();
+            // failed
+            if( imerr ){
+                retval = ThrowException( Exception::Error( String::New( ImlibStrError( imerr ) ) ) );
+            }
+        }
+    }
     
-    return scope.Close( argv.This() );
+    return scope.Close( retval );
 }
 
-
-Handle<Value> Imlib2::loadImage( const char *path )
+// collect delay of frames 0..n-1. GIF is read in one pass without lock.
+// other formats load each frame; lock is taken for each frame so other 
+// tasks can run in between, and each frame load decodes its predecessors.
+int Imlib2::collectDelays( const char *path, int n, int *delays )
 {
-    Handle<Value> retval = Undefined();
-    ImageErrorType_e imerr = NOERR;
+#ifdef HAVE_IMLIB_FRAME
+    Imlib_Frame_Info info;
+    Imlib_Image loaded;
+    int i, rc;
     
-    if( imlib_context_get_image() )
+    if( GifDelays( path, n, delays ) ){
+        return 0;
+    }
+    for( i = 0; i < n; i++ )
     {
-        if( imlib_get_cache_size() ){
+        if( ( rc = enter() ) ){
+            return rc;
+        }
+        else if( ( loaded = imlib_load_image_frame( path, i + 1 ) ) ){
+            imlib_context_set_image( loaded );
+            imlib_image_get_frame_info( &info );
+            delays[i] = info.frame_delay;
             imlib_free_image_and_decache();
         }
         else {
-            imlib_free_image();
+            delays[i] = 0;
+        }
+        if( ( rc = leave() ) ){
+            return rc;
         }
     }
-    
-    img = imlib_load_image_with_error_return( path, (Imlib_Load_Error*)&imerr );
-    if( imerr ){
-        retval = String::New( ImlibStrError(imerr) );
-    }
-    else
-    {
-        attached = 1;
-        src = strdup(path);
-        imlib_context_set_image( img );
-        format = imlib_image_format();
-        size.w = crop.w = resize.w = imlib_image_get_width();
-        size.h = crop.h = resize.h = imlib_image_get_height();
-        size.aspect = crop.aspect = (double)size.w/(double)size.h;
-        img = imlib_clone_image();
-        imlib_free_image_and_decache();
+#else
+    if( n > 0 ){
+        delays[0] = delay;
     }
+#endif
     
-    return retval;
+    return 0;
 }
 
-Handle<Value> Imlib2::fnLoad( const Arguments& argv )
+Handle<Value> Imlib2::fnDelays( const Arguments& argv )
 {
     HandleScope scope;
     Imlib2 *ctx = ObjectUnwrap( Imlib2, argv.This() );
     Handle<Value> retval = Undefined();
     const int argc = argv.Length();
     bool callback = false;
-
-    if( argc < 1 || 
-        !argv[0]->IsString() || !argv[0]->ToString()->Length() ||
-        ( argc > 1 && !( callback = argv[1]->IsFunction() ) ) ){
-        retval = ThrowException( Exception::TypeError( String::New( "load( path_to_image:String, [callback:Function] )" ) ) );
+    int *delays;
+    int rc;
+    
+    if( argc > 0 && !( callback = argv[0]->IsFunction() ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "delays( [callback:Function] )" ) ) );
+    }
+    // src and nframe are replaced by async task
+    else if( ctx->pending ){
+        retval = ThrowException( Exception::Error( String::New( "delays() while async task is pending" ) ) );
+    }
+    else if( !ctx->src ){
+        retval = ThrowException( Exception::Error( String::New( "image not loaded" ) ) );
+    }
+    else if( !( delays = (int*)calloc( ctx->nframe, sizeof(int) ) ) ){
+        retval = ThrowException( Exception::Error( String::New( strerror(errno) ) ) );
     }
     else if( callback )
     {
-        Baton_t *baton = new Baton_t();
+        Baton_t *baton = BatonAlloc();
         
-        baton->task = ASYNC_TASK_LOAD;
+        baton->task = ASYNC_TASK_DELAYS;
         baton->ctx = (void*)ctx;
-        baton->retval = Undefined();
-        baton->errstr = NULL;
-        baton->udata = strdup( *String::Utf8Value( argv[0] ) );
+        baton->delays = delays;
+        baton->nframe = ctx->nframe;
+        if( !BatonSetPath( baton, ctx->src ) ){
+            free( (void*)delays );
+            baton->delays = NULL;
+            BatonRelease( baton );
+            return scope.Close( ThrowException( Exception::Error( String::New( strerror(errno) ) ) ) );
+        }
         // detouch from GC
-        baton->callback = Persistent<Function>::New( Local<Function>::Cast( argv[1] ) );
-        ctx->Wrap( argv.This() );
+        baton->callback = Persistent<Function>::New( Local<Function>::Cast( argv[0] ) );
         ctx->Ref();
+        ctx->pending++;
         baton->req = eio_custom( beginEIO, EIO_PRI_DEFAULT, endEIO, baton );
         ev_ref(EV_DEFAULT_UC);
     }
+    else if( ( rc = ctx->collectDelays( ctx->src, ctx->nframe, delays ) ) ){
+        free( (void*)delays );
+        retval = ThrowException( Exception::Error( String::New( strerror(rc) ) ) );
+    }
     else
     {
-        retval = ctx->loadImage( *String::Utf8Value( argv[0] ) );
-        // failed
-        if( IsDefined( retval ) ){
-            retval = ThrowException( Exception::Error( retval->ToString() ) );
+        Local<Array> list = Array::New( ctx->nframe );
+        int i;
+        
+        for( i = 0; i < ctx->nframe; i++ ){
+            list->Set( i, Number::New( delays[i] ) );
         }
+        free( (void*)delays );
+        retval = list;
     }
     
     return scope.Close( retval );
 }
 
-Handle<Value> Imlib2::saveImage( const char *path )
+// render and save; must be called while holding lock
+ImageErrorType_e Imlib2::saveImage( const char *path )
 {
-    Handle<Value> retval = Undefined();
+    ImageErrorType_e imerr = NOERR;
     
-    if( img )
+    // decode deferred by load(); stays deferred if decode fails
+    if( deferred && src )
     {
-        ImageErrorType_e imerr = NOERR;
-        Imlib_Image work = img, clone;
+        struct stat st;
         
-        // set current image
-        imlib_context_set_image( work );
-        // clone current image for backup
-        img = imlib_clone_image();
+        // attributes given by load() belong to the source seen then
+        if( stat( src, &st ) || SourceChanged( &st, &srcstat ) ){
+            return SOURCE_CHANGED;
+        }
+        else if( ( imerr = decodeImage( src, frame ) ) ){
+            return imerr;
+        }
+        deferred = 0;
+    }
+    
+    if( img )
+    {
+        int sx = 0, sy = 0, sw = size.w, sh = size.h;
+        int dw, dh;
+        Imlib_Image work;
+        char alpha;
         
         // crop
         if( cropped ){
-            work = imlib_create_cropped_image( x, y, crop.w, crop.h );
-            imlib_free_image_and_decache();
-            imlib_context_set_image( work );
+            sx = x;
+            sy = y;
+            sw = crop.w;
+            sh = crop.h;
         }
         // resize
-        if( resized )
-        {
-            if( cropped ){
-                work = imlib_create_cropped_scaled_image( 0, 0, crop.w, crop.h, resize.w, resize.h );
-            }
-            else{
-                work = imlib_create_cropped_scaled_image( 0, 0, size.w, size.h, resize.w, resize.h );
-            }
-            imlib_free_image_and_decache();
-            imlib_context_set_image( work );
+        if( resized ){
+            dw = resize.w;
+            dh = resize.h;
+        }
+        else {
+            dw = sw;
+            dh = sh;
+        }
+        
+        imlib_context_set_image( img );
+        alpha = imlib_image_has_alpha();
+        if( dw < 1 || dh < 1 || sw < 1 || sh < 1 ){
+            return INVALID_SIZE;
         }
+        // crop and scale into scratch buffer; source is left untouched
+        else if( !( work = ScratchImage( dw, dh ) ) ){
+            return OUT_OF_MEMORY;
+        }
+        imlib_context_set_image( work );
+        imlib_image_set_has_alpha( alpha );
+        imlib_context_set_blend( 0 );
+        imlib_blend_image_onto_image( img, 1, sx, sy, sw, sh, 0, 0, dw, dh );
+        
         // quality
         imlib_image_attach_data_value( "quality", NULL, quality, NULL );
         // format
         if( format_to ){
             imlib_image_set_format( format_to );
         }
+        else if( format ){
+            imlib_image_set_format( format );
+        }
         
         imlib_save_image_with_error_return( path, (ImlibLoadError*)&imerr );
-        imlib_free_image_and_decache();
-        // failed
-        if( imerr ){
-            retval = String::New( ImlibStrError( imerr ) );
-        }
+        imlib_free_image();
+    }
+    
+    return imerr;
+}
+
+// save through output cache. cache lookup and store run without lock; 
+// lock is taken only to render. returns errno if lock failed
+int Imlib2::saveFile( const char *path, ImageErrorType_e *imerr )
+{
+    char *key = ( OutCacheEnabled() && srcstat_ok && src ) ? outputKey() : NULL;
+    int rc;
+    
+    *imerr = NOERR;
+    // same output was rendered before
+    if( key && OutCacheFetch( key, path, imerr ) ){
+        free( (void*)key );
+        return 0;
+    }
+    else if( ( rc = enter() ) ){
+        free( (void*)key );
+        return rc;
+    }
+    
+    *imerr = saveImage( path );
+    rc = leave();
+    if( !*imerr && key ){
+        OutCacheStore( key, path );
     }
+    free( (void*)key );
     
-    return retval;
+    return rc;
 }
 
 Handle<Value> Imlib2::fnSave( const Arguments &argv )
@@ -457,25 +2129,80 @@ Handle<Value> Imlib2::fnSave( const Arguments &argv )
         ( argc > 1 && !( callback = argv[1]->IsFunction() ) ) ){
         retval = ThrowException( Exception::TypeError( String::New( "save( path_to_file:String, [callback:Function] )" ) ) );
     }
+    // output key is built from state an async task may replace
+    else if( ctx->pending ){
+        retval = ThrowException( Exception::Error( String::New( "save() while async task is pending" ) ) );
+    }
     else if( callback )
     {
-        Baton_t *baton = new Baton_t();
+        Baton_t *baton = BatonAlloc();
         
         baton->task = ASYNC_TASK_SAVE;
         baton->ctx = (void*)ctx;
-        baton->retval = Undefined();
-        baton->errstr = NULL;
-        baton->udata = strdup( *String::Utf8Value( argv[0] ) );
+        if( !BatonSetPath( baton, *String::Utf8Value( argv[0] ) ) ){
+            BatonRelease( baton );
+            return scope.Close( ThrowException( Exception::Error( String::New( strerror(errno) ) ) ) );
+        }
         // detouch from GC
         baton->callback = Persistent<Function>::New( Local<Function>::Cast( argv[1] ) );
         ctx->Ref();
+        ctx->pending++;
         baton->req = eio_custom( beginEIO, EIO_PRI_DEFAULT, endEIO, baton );
         ev_ref(EV_DEFAULT_UC);
     }
-    else {
-        const char *path = strdup( *String::Utf8Value( argv[0] ) );
-        ctx->saveImage( path );
-        free((void*)path);
+    else
+    {
+        ImageErrorType_e imerr;
+        int rc;
+        
+        if( ( rc = ctx->saveFile( *String::Utf8Value( argv[0] ), &imerr ) ) ){
+            retval = ThrowException( Exception::Error( String::New( strerror(rc) ) ) );
+        }
+        // failed
+        else if( imerr ){
+            retval = ThrowException( Exception::Error( String::New( ImlibStrError( imerr ) ) ) );
+        }
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> Imlib2::fnReset( const Arguments &argv )
+{
+    HandleScope scope;
+    Imlib2 *ctx = ObjectUnwrap( Imlib2, argv.This() );
+    Handle<Value> retval = argv.This();
+    int rc;
+    
+    // async task still refers to img/src
+    if( ctx->pending ){
+        retval = ThrowException( Exception::Error( String::New( "reset() while async task is pending" ) ) );
+    }
+    else if( ( rc = ctx->enter() ) ){
+        retval = ThrowException( Exception::Error( String::New( strerror(rc) ) ) );
+    }
+    else
+    {
+        // keep current image as spare to reuse its pixel buffer on next load
+        if( ctx->img )
+        {
+            if( ctx->spare ){
+                imlib_context_set_image( ctx->spare );
+                imlib_free_image();
+                ctx->spare = NULL;
+            }
+            imlib_context_set_image( ctx->img );
+            if( (size_t)imlib_image_get_width() * imlib_image_get_height() * 
+                sizeof(DATA32) <= SPARE_MAX_BYTES ){
+                ctx->spare = ctx->img;
+                ctx->img = NULL;
+            }
+            else {
+                ctx->releaseImage();
+            }
+        }
+        ctx->initState();
+        ctx->leave();
     }
     
     return scope.Close( retval );
@@ -494,7 +2221,15 @@ void Imlib2::setFormat( Local<String>, Local<Value> val, const AccessorInfo &inf
     HandleScope scope;
     Imlib2 *ctx = ObjectUnwrap( Imlib2, info.This() );
     
-    if( val->IsString() && val->ToString()->Length() ){
+    // async task may be reading format_to
+    if( ctx->pending ){
+        ThrowException( Exception::Error( String::New( "format cannot be changed while async task is pending" ) ) );
+    }
+    else if( val->IsString() && val->ToString()->Length() )
+    {
+        if( ctx->format_to ){
+            free( (void*)ctx->format_to );
+        }
         ctx->format_to = strdup( *String::Utf8Value( val ) );
     }
 }
@@ -531,6 +2266,25 @@ Handle<Value> Imlib2::getQuality( Local<String>, const AccessorInfo &info )
     Imlib2 *ctx = ObjectUnwrap( Imlib2, info.This() );
     return scope.Close( Number::New( ctx->quality ) );
 }
+Handle<Value> Imlib2::getFrameCount( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    Imlib2 *ctx = ObjectUnwrap( Imlib2, info.This() );
+    return scope.Close( Number::New( ctx->nframe ) );
+}
+Handle<Value> Imlib2::getFrameIndex( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    Imlib2 *ctx = ObjectUnwrap( Imlib2, info.This() );
+    return scope.Close( Number::New( ctx->frame ) );
+}
+Handle<Value> Imlib2::getDelay( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    Imlib2 *ctx = ObjectUnwrap( Imlib2, info.This() );
+    return scope.Close( Number::New( ctx->delay ) );
+}
+
 void Imlib2::setQuality( Local<String>, Local<Value> val, const AccessorInfo &info )
 {
     HandleScope scope;
@@ -545,6 +2299,26 @@ void Imlib2::setQuality( Local<String>, Local<Value> val, const AccessorInfo &in
     }
 }
 
+Handle<Value> Imlib2::getMmap( Local<String>, const AccessorInfo &info )
+{
+    HandleScope scope;
+    Imlib2 *ctx = ObjectUnwrap( Imlib2, info.This() );
+    return scope.Close( Boolean::New( ctx->mapped ) );
+}
+void Imlib2::setMmap( Local<String>, Local<Value> val, const AccessorInfo &info )
+{
+    HandleScope scope;
+    Imlib2 *ctx = ObjectUnwrap( Imlib2, info.This() );
+    
+#ifdef HAVE_IMLIB_LOAD_MEM
+    ctx->mapped = val->BooleanValue();
+#else
+    if( val->BooleanValue() ){
+        ThrowException( Exception::Error( String::New( "mmap input requires imlib2 >= 1.10" ) ) );
+    }
+#endif
+}
+
 Handle<Value> Imlib2::fnCrop( const Arguments &argv )
 {
     HandleScope scope;
@@ -754,14 +2528,110 @@ Handle<Value> Imlib2::fnResizeByHeight( const Arguments &argv )
     return scope.Close( retval );
 }
 
+Handle<Value> Imlib2::fnScratchStats( const Arguments& )
+{
+    HandleScope scope;
+    Local<Object> stats = Object::New();
+    unsigned long hit = __sync_fetch_and_add( &scratch_hit, 0 );
+    unsigned long miss = __sync_fetch_and_add( &scratch_miss, 0 );
+    
+    stats->Set( String::NewSymbol("hit"), Number::New( hit ) );
+    stats->Set( String::NewSymbol("miss"), Number::New( miss ) );
+    stats->Set( String::NewSymbol("rate"), 
+                Number::New( ( hit + miss ) ? (double)hit / (double)( hit + miss ) : 0 ) );
+    
+    return scope.Close( stats );
+}
+
+Handle<Value> Imlib2::fnCache( const Arguments& argv )
+{
+    HandleScope scope;
+    Handle<Value> retval = Undefined();
+    const int argc = argv.Length();
+    Local<Value> bytes, dir, dirBytes;
+    
+    if( argc > 0 && argv[0]->IsObject() ){
+        bytes = argv[0]->ToObject()->Get( String::NewSymbol("bytes") );
+        dir = argv[0]->ToObject()->Get( String::NewSymbol("dir") );
+        dirBytes = argv[0]->ToObject()->Get( String::NewSymbol("dirBytes") );
+    }
+    
+    if( argc < 1 || !argv[0]->IsObject() ||
+        ( IsDefined( bytes ) && !bytes->IsNumber() ) ||
+        ( IsDefined( dir ) && !dir->IsString() ) ||
+        ( IsDefined( dirBytes ) && !dirBytes->IsNumber() ) ){
+        retval = ThrowException( Exception::TypeError( String::New( "cache( { bytes:Number, dir:String, dirBytes:Number } )" ) ) );
+    }
+    else
+    {
+        OutCache_t *entry;
+        
+        pthread_mutex_lock( &outcache.mutex );
+        OutCacheClear();
+        if( outcache.dir ){
+            free( (void*)outcache.dir );
+            outcache.dir = NULL;
+        }
+        outcache.budget = ( bytes->IsNumber() && bytes->NumberValue() > 0 ) ? 
+                          (size_t)bytes->NumberValue() : 0;
+        if( dir->IsString() && dir->ToString()->Length() ){
+            outcache.dir = strdup( *String::Utf8Value( dir ) );
+        }
+        
+        // drop pending and written spill files of previous configuration
+        pthread_mutex_lock( &spill.mutex );
+        while( ( entry = spill.qhead ) ){
+            spill.qhead = entry->next;
+            OutCacheFree( entry );
+        }
+        spill.qtail = NULL;
+        SpillForget( 1 );
+        spill.budget = ( dirBytes->IsNumber() && dirBytes->NumberValue() > 0 ) ?
+                       (size_t)dirBytes->NumberValue() : SPILL_DIR_BYTES;
+        if( outcache.dir && !spill.running )
+        {
+            pthread_t tid;
+            
+            if( pthread_create( &tid, NULL, SpillMain, NULL ) == 0 ){
+                pthread_detach( tid );
+                spill.running = 1;
+            }
+        }
+        pthread_mutex_unlock( &spill.mutex );
+        
+        if( outcache.dir ){
+            SpillCleanup( outcache.dir );
+        }
+        __sync_lock_test_and_set( &outcache.enabled, 
+                                  ( outcache.budget || outcache.dir ) ? 1 : 0 );
+        pthread_mutex_unlock( &outcache.mutex );
+    }
+    
+    return scope.Close( retval );
+}
+
+Handle<Value> Imlib2::fnCacheStats( const Arguments& )
+{
+    HandleScope scope;
+    Local<Object> stats = Object::New();
+    
+    stats->Set( String::NewSymbol("hit"), 
+                Number::New( __sync_fetch_and_add( &outcache.hit, 0 ) ) );
+    stats->Set( String::NewSymbol("miss"), 
+                Number::New( __sync_fetch_and_add( &outcache.miss, 0 ) ) );
+    stats->Set( String::NewSymbol("bytes"), 
+                Number::New( __sync_fetch_and_add( &outcache.bytes, 0 ) ) );
+    stats->Set( String::NewSymbol("entries"), 
+                Number::New( __sync_fetch_and_add( &outcache.entries, 0 ) ) );
+    
+    return scope.Close( stats );
+}
 
 void Imlib2::Initialize( Handle<Object> target )
 {
     HandleScope scope;
     Local<FunctionTemplate> t = FunctionTemplate::New( New );
     
-    pthread_mutex_init( &mutex, NULL );
-    
     t->InstanceTemplate()->SetInternalFieldCount(1);
     t->SetClassName( String::NewSymbol("Imlib2") );
     
@@ -772,14 +2642,25 @@ void Imlib2::Initialize( Handle<Object> target )
     NODE_SET_PROTOTYPE_METHOD( t, "resizeByHeight", fnResizeByHeight );
     NODE_SET_PROTOTYPE_METHOD( t, "load", fnLoad );
     NODE_SET_PROTOTYPE_METHOD( t, "save", fnSave );
+    NODE_SET_PROTOTYPE_METHOD( t, "reset", fnReset );
+    NODE_SET_PROTOTYPE_METHOD( t, "frame", fnFrame );
+    NODE_SET_PROTOTYPE_METHOD( t, "delays", fnDelays );
     
     Local<ObjectTemplate> proto = t->PrototypeTemplate();
     proto->SetAccessor(String::NewSymbol("format"), getFormat, setFormat );
     proto->SetAccessor(String::NewSymbol("quality"), getQuality, setQuality );
+    proto->SetAccessor(String::NewSymbol("mmap"), getMmap, setMmap );
     proto->SetAccessor(String::NewSymbol("rawWidth"), getRawWidth );
     proto->SetAccessor(String::NewSymbol("rawHeight"), getRawHeight );
     proto->SetAccessor(String::NewSymbol("width"), getWidth );
     proto->SetAccessor(String::NewSymbol("height"), getHeight );
+    proto->SetAccessor(String::NewSymbol("frameCount"), getFrameCount );
+    proto->SetAccessor(String::NewSymbol("frameIndex"), getFrameIndex );
+    proto->SetAccessor(String::NewSymbol("delay"), getDelay );
+    
+    NODE_SET_METHOD( t->GetFunction(), "scratchStats", fnScratchStats );
+    NODE_SET_METHOD( t->GetFunction(), "cache", fnCache );
+    NODE_SET_METHOD( t->GetFunction(), "cacheStats", fnCacheStats );
     
     target->Set( String::NewSymbol("Imlib2"), t->GetFunction() );
 }